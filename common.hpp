@@ -10,6 +10,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -96,6 +97,7 @@ static void write_size_str(size_t x, char* buf) {
   }
 }
 
+UNUSED
 static void parse_options(int argc, char** argv, Options& options) {
   struct option long_options[] = {
     { "verbose",              no_argument,       0, 0 },
@@ -386,3 +388,78 @@ static void log_perf_count() {
   read_perf_count(count);
   log("page faults: %ld\n", count.faults);
 }
+
+// CPU accounting. User and system time come from getrusage -- both programs
+// are single threaded. Spinning is the time spent busy looping on syscalls
+// returning EAGAIN or polls returning nothing, and is a portion of the user and
+// system time. It's measured with the thread CPU clock, so that time we spend
+// preempted while spinning isn't counted.
+
+struct CpuUsage {
+  double user_seconds = 0;
+  double system_seconds = 0;
+  double spin_seconds = 0;
+};
+
+static struct rusage cpu_usage_rusage_start;
+static double spin_started = -1;
+static double spin_seconds = 0;
+
+static double thread_cpu_seconds() {
+  struct timespec tspec;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tspec) < 0) {
+    fail("could not get time: %s", strerror(errno));
+  }
+  return ((double) tspec.tv_sec) + ((double) tspec.tv_nsec)/1000000000.0;
+}
+
+static double timeval_seconds(const struct timeval& tv) {
+  return ((double) tv.tv_sec) + ((double) tv.tv_usec)/1000000.0;
+}
+
+// Called on every unsuccessful attempt, only reads the clock on the first one.
+UNUSED
+static inline void spin_begin() {
+  if (spin_started < 0) {
+    spin_started = thread_cpu_seconds();
+  }
+}
+
+// Called on every successful attempt, only reads the clock if we were spinning.
+UNUSED
+static inline void spin_end() {
+  if (spin_started >= 0) {
+    spin_seconds += thread_cpu_seconds() - spin_started;
+    spin_started = -1;
+  }
+}
+
+UNUSED
+static void start_cpu_usage() {
+  if (getrusage(RUSAGE_SELF, &cpu_usage_rusage_start) < 0) {
+    fail("could not get resource usage: %s", strerror(errno));
+  }
+  spin_started = -1;
+  spin_seconds = 0;
+}
+
+UNUSED
+static void stop_cpu_usage(CpuUsage& usage) {
+  spin_end();
+  struct rusage end;
+  if (getrusage(RUSAGE_SELF, &end) < 0) {
+    fail("could not get resource usage: %s", strerror(errno));
+  }
+  usage.user_seconds = timeval_seconds(end.ru_utime) - timeval_seconds(cpu_usage_rusage_start.ru_utime);
+  usage.system_seconds = timeval_seconds(end.ru_stime) - timeval_seconds(cpu_usage_rusage_start.ru_stime);
+  usage.spin_seconds = spin_seconds;
+}
+
+UNUSED
+static double gibibytes_per_cpu_second(size_t bytes, const CpuUsage& usage) {
+  double cpu_seconds = usage.user_seconds + usage.system_seconds;
+  if (cpu_seconds <= 0) {
+    return 0;
+  }
+  return (((double) bytes) / (1ull << 30)) / cpu_seconds;
+}
@@ -0,0 +1,369 @@
+// Background interference to run alongside `./write | ./read`, to see how
+// the various configurations hold up on a busy host rather than on a quiet
+// box. Runs one worker per CPU given with --cpus, each pinned to its CPU,
+// until killed.
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "common.hpp"
+
+enum class Mode {
+  // Streams through a large buffer with memcpy, saturating memory bandwidth.
+  MEMBW,
+  // Touches random cache lines in a buffer twice the size of the LLC,
+  // evicting whatever the pipe pair has in there.
+  LLC,
+  // Faults in 4KiB pages and frees every other one, keeping the rest mapped
+  // up to a budget. Physical memory stays fragmented, so huge page
+  // allocations need compaction.
+  THP_FRAGMENT,
+  // Writes and reads back large files, filling the page cache with dirty
+  // pages and keeping reclaim and writeback busy.
+  PAGE_CACHE,
+};
+
+struct InterfereOptions {
+  Mode mode = Mode::MEMBW;
+  // CPUs to run workers on, one worker per CPU
+  int cpus[CPU_SETSIZE];
+  size_t num_cpus = 0;
+  // Size of the memory or file each worker churns through. For THP_FRAGMENT,
+  // this is how much fragmented memory each worker keeps. If not given, a
+  // default depending on the mode is used.
+  size_t buf_size = 0;
+  // Where to put the files for PAGE_CACHE. They are unlinked straight away.
+  const char* dir = ".";
+};
+
+static const char* mode_str(Mode mode) {
+  switch (mode) {
+  case Mode::MEMBW: return "membw";
+  case Mode::LLC: return "llc";
+  case Mode::THP_FRAGMENT: return "thp_fragment";
+  case Mode::PAGE_CACHE: return "page_cache";
+  }
+  return "unknown";
+}
+
+static Mode read_mode_str(const char* str) {
+  const Mode modes[] = { Mode::MEMBW, Mode::LLC, Mode::THP_FRAGMENT, Mode::PAGE_CACHE };
+  for (Mode mode : modes) {
+    if (strcmp(mode_str(mode), str) == 0) {
+      return mode;
+    }
+  }
+  fail("bad mode %s, expected one of membw, llc, thp_fragment, page_cache\n", str);
+}
+
+// Parses a comma separated list of CPUs, e.g. `2,3`
+static void read_cpus_str(const char* list, InterfereOptions& options) {
+  options.num_cpus = 0;
+  const char* str = list;
+  while (*str) {
+    if (options.num_cpus == CPU_SETSIZE) {
+      fail("too many cpus in %s\n", list);
+    }
+    char* end;
+    long cpu = strtol(str, &end, 10);
+    if (
+      end == str || cpu < 0 || cpu >= CPU_SETSIZE ||
+      (*end != ',' && *end != '\0') || (*end == ',' && end[1] == '\0')
+    ) {
+      fail("bad cpu list %s\n", list);
+    }
+    options.cpus[options.num_cpus++] = cpu;
+    str = *end == ',' ? end + 1 : end;
+  }
+}
+
+static size_t read_proc_size(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+  size_t x = 0;
+  if (fscanf(f, "%zu", &x) != 1) {
+    x = 0;
+  }
+  fclose(f);
+  return x;
+}
+
+// Roughly how much dirty page cache the kernel allows before it throttles
+// writers, from vm.dirty_bytes or vm.dirty_ratio. The kernel computes the
+// ratio on reclaimable memory rather than on all of it, but this is close
+// enough to size the files.
+static size_t dirty_limit() {
+  size_t dirty_bytes = read_proc_size("/proc/sys/vm/dirty_bytes");
+  if (dirty_bytes) {
+    return dirty_bytes;
+  }
+  size_t dirty_ratio = read_proc_size("/proc/sys/vm/dirty_ratio");
+  long pages = sysconf(_SC_PHYS_PAGES);
+  if (!dirty_ratio || pages <= 0) {
+    return 1ull << 30;
+  }
+  return (size_t) pages * PAGE_SIZE / 100 * dirty_ratio;
+}
+
+// Cap on the default PAGE_CACHE file size, so that the default doesn't fill
+// up the disk on hosts with a lot of memory. Use --buf_size to go beyond it.
+#define PAGE_CACHE_MAX_DEFAULT_SIZE ((1ull << 30) * 16ull)
+
+static size_t default_buf_size(const InterfereOptions& options) {
+  switch (options.mode) {
+  case Mode::MEMBW:
+    return 1ull << 28; // 256MiB, well beyond any cache
+  case Mode::LLC: {
+    long llc_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    return llc_size > 0 ? 2 * (size_t) llc_size : (1ull << 26);
+  }
+  case Mode::THP_FRAGMENT:
+    return 1ull << 30;
+  case Mode::PAGE_CACHE: {
+    // Twice the dirty limit between all the workers keeps them throttled on
+    // writeback, and churning the page cache.
+    size_t total = 2 * dirty_limit();
+    if (total > PAGE_CACHE_MAX_DEFAULT_SIZE) {
+      total = PAGE_CACHE_MAX_DEFAULT_SIZE;
+    }
+    return total / options.num_cpus;
+  }
+  }
+  return 0;
+}
+
+static void parse_interfere_options(int argc, char** argv, InterfereOptions& options) {
+  struct option long_options[] = {
+    { "verbose",              no_argument,       0, 0 },
+    { "mode",                 required_argument, 0, 0 },
+    { "cpus",                 required_argument, 0, 0 },
+    { "buf_size",             required_argument, 0, 0 },
+    { "dir",                  required_argument, 0, 0 },
+    { 0,                      0,                 0, 0 }
+  };
+
+  opterr = 0; // we handle errors ourselves
+  while (true) {
+    int option_index;
+    int c = getopt_long(argc, argv, "", long_options, &option_index);
+    if (c == -1) {
+      break;
+    } else if (c == '?') {
+      optind--; // we want to print the one we just skipped over as well
+      fprintf(stderr, "bad usage, non-option arguments starting from:\n  ");
+      while (optind < argc) {
+        fprintf(stderr, "%s ", argv[optind++]);
+      }
+      fprintf(stderr, "\n");
+      exit(EXIT_FAILURE);
+    } else if (c == 0) {
+      const char* option = long_options[option_index].name;
+      verbose = verbose || (strcmp("verbose", option) == 0);
+      if (strcmp("mode", option) == 0) {
+        options.mode = read_mode_str(optarg);
+      }
+      if (strcmp("cpus", option) == 0) {
+        read_cpus_str(optarg, options);
+      }
+      if (strcmp("buf_size", option) == 0) {
+        options.buf_size = read_size_str(optarg);
+        if (options.buf_size == 0) {
+          fail("--buf_size must be positive\n");
+        }
+      }
+      if (strcmp("dir", option) == 0) {
+        options.dir = optarg;
+      }
+    } else {
+      fail("getopt returned character code 0%o\n", c);
+    }
+  }
+
+  if (options.num_cpus == 0) {
+    fail("--cpus is required\n");
+  }
+  if (options.buf_size == 0) {
+    options.buf_size = default_buf_size(options);
+  }
+
+  log("mode\t\t\t%s\n", mode_str(options.mode));
+  log("cpus\t\t\t");
+  for (size_t i = 0; i < options.num_cpus; i++) {
+    log("%s%d", i ? "," : "", options.cpus[i]);
+  }
+  log("\n");
+  log("buf_size\t\t%zu\n", options.buf_size);
+  log("dir\t\t\t%s\n", options.dir);
+  log("\n");
+}
+
+// Stops the compiler from optimizing away loops which only touch memory.
+#define CLOBBER_MEMORY() asm volatile("" ::: "memory")
+
+NOINLINE
+static void membw(const InterfereOptions& options) {
+  size_t half = options.buf_size / 2;
+  char* buf = (char*) malloc(options.buf_size);
+  if (!buf) {
+    fail("could not allocate buffer\n");
+  }
+  memset(buf, 'X', options.buf_size);
+  while (true) {
+    memcpy(buf + half, buf, half);
+    memcpy(buf, buf + half, half);
+    CLOBBER_MEMORY();
+  }
+}
+
+#define CACHE_LINE_SIZE 64
+
+NOINLINE
+static void llc(const InterfereOptions& options) {
+  size_t lines = options.buf_size / CACHE_LINE_SIZE;
+  char* buf = (char*) aligned_alloc(CACHE_LINE_SIZE, lines * CACHE_LINE_SIZE);
+  if (!buf) {
+    fail("could not allocate buffer\n");
+  }
+  memset(buf, 'X', lines * CACHE_LINE_SIZE);
+  // xorshift64, random enough to defeat the prefetchers
+  uint64_t state = 88172645463325252ull;
+  while (true) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    buf[(state % lines) * CACHE_LINE_SIZE]++;
+    CLOBBER_MEMORY();
+  }
+}
+
+// Size of each region we fault in and then punch holes in.
+#define THP_FRAGMENT_REGION_SIZE (HPAGE_SIZE * 32)
+
+NOINLINE
+static void thp_fragment(const InterfereOptions& options) {
+  // Half of each region survives, so we need twice the budget in regions.
+  size_t num_regions = (2 * options.buf_size + THP_FRAGMENT_REGION_SIZE - 1) / THP_FRAGMENT_REGION_SIZE;
+  char** regions = (char**) calloc(num_regions, sizeof(char*));
+  if (!regions) {
+    fail("could not allocate regions\n");
+  }
+  for (size_t region_ix = 0; region_ix < num_regions; region_ix++) {
+    void* buf = mmap(NULL, THP_FRAGMENT_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+      fail("could not map region: %s", strerror(errno));
+    }
+    // Fault in 4KiB pages: dropping 4KiB pieces of a huge page would only
+    // queue it for a deferred split, not free anything. This also stops
+    // khugepaged from collapsing what's left back into huge pages.
+    if (madvise(buf, THP_FRAGMENT_REGION_SIZE, MADV_NOHUGEPAGE) < 0) {
+      fail("could not disable huge pages: %s", strerror(errno));
+    }
+    memset(buf, 'X', THP_FRAGMENT_REGION_SIZE);
+    regions[region_ix] = (char*) buf;
+  }
+  // Free every other 4KiB page. Pages faulted in one after the other tend to
+  // be physically contiguous, so this leaves 4KiB holes which the buddy
+  // allocator can't merge, pinned down by the pages we keep. We only do this
+  // once everything is faulted in, otherwise the next region would just fill
+  // the holes back in.
+  for (size_t region_ix = 0; region_ix < num_regions; region_ix++) {
+    for (size_t i = PAGE_SIZE; i < THP_FRAGMENT_REGION_SIZE; i += 2*PAGE_SIZE) {
+      if (madvise(regions[region_ix] + i, PAGE_SIZE, MADV_DONTNEED) < 0) {
+        fail("could not drop page: %s", strerror(errno));
+      }
+    }
+  }
+  log("fragmented %zu regions\n", num_regions);
+  // Keep touching the pages we kept so that they stay resident.
+  while (true) {
+    for (size_t region_ix = 0; region_ix < num_regions; region_ix++) {
+      for (size_t i = 0; i < THP_FRAGMENT_REGION_SIZE; i += 2*PAGE_SIZE) {
+        regions[region_ix][i]++;
+      }
+    }
+    CLOBBER_MEMORY();
+    sleep(1);
+  }
+}
+
+NOINLINE
+static void page_cache(const InterfereOptions& options) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/interfere-XXXXXX", options.dir);
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fail("could not create file in %s: %s", options.dir, strerror(errno));
+  }
+  if (unlink(path) < 0) {
+    fail("could not unlink %s: %s", path, strerror(errno));
+  }
+  const size_t chunk_size = 1 << 20;
+  char* chunk = (char*) malloc(chunk_size);
+  if (!chunk) {
+    fail("could not allocate buffer\n");
+  }
+  memset(chunk, 'X', chunk_size);
+  while (true) {
+    for (size_t offset = 0; offset < options.buf_size; offset += chunk_size) {
+      if (pwrite(fd, chunk, chunk_size, offset) < 0) {
+        fail("could not write to page cache file: %s", strerror(errno));
+      }
+    }
+    for (size_t offset = 0; offset < options.buf_size; offset += chunk_size) {
+      if (pread(fd, chunk, chunk_size, offset) < 0) {
+        fail("could not read from page cache file: %s", strerror(errno));
+      }
+    }
+  }
+}
+
+struct Worker {
+  const InterfereOptions* options;
+  int cpu;
+  pthread_t thread;
+};
+
+static void* run_worker(void* arg) {
+  Worker* worker = (Worker*) arg;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(worker->cpu, &cpu_set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+    fail("could not pin worker to cpu %d\n", worker->cpu);
+  }
+  log("starting %s worker on cpu %d\n", mode_str(worker->options->mode), worker->cpu);
+  switch (worker->options->mode) {
+  case Mode::MEMBW: membw(*worker->options); break;
+  case Mode::LLC: llc(*worker->options); break;
+  case Mode::THP_FRAGMENT: thp_fragment(*worker->options); break;
+  case Mode::PAGE_CACHE: page_cache(*worker->options); break;
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  InterfereOptions options;
+  parse_interfere_options(argc, argv, options);
+
+  Worker* workers = (Worker*) calloc(options.num_cpus, sizeof(Worker));
+  if (!workers) {
+    fail("could not allocate workers\n");
+  }
+  for (size_t i = 0; i < options.num_cpus; i++) {
+    workers[i].options = &options;
+    workers[i].cpu = options.cpus[i];
+    int ret = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    if (ret != 0) {
+      fail("could not start worker: %s", strerror(ret));
+    }
+  }
+  // The workers never return, we run until we're killed.
+  for (size_t i = 0; i < options.num_cpus; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  return 0;
+}
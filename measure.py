@@ -1,10 +1,19 @@
 from tqdm import tqdm
+import argparse
+import csv
 import dataclasses
+import datetime
+import io
 import numpy as np
 import os
+import pathlib
 import pandas
+import socket
+import sqlite3
 import subprocess
 import random
+import sys
+import time
 
 @dataclasses.dataclass
 class RunOptions:
@@ -33,20 +42,46 @@ def build_flags(run_options):
       flags.append(f'--{field}={value}')
   return flags
 
-def run(run_options):
+# Where `./write` and `./read` are pinned, interference must stay off these.
+write_cpu = 0
+read_cpu = 1
+
+def run(run_options, interference):
   flags = build_flags(run_options)
-  with subprocess.Popen(
-    ['taskset', '1', './write'] + flags,
+  write = subprocess.Popen(
+    ['taskset', '-c', str(write_cpu), './write'] + flags,
     stdout=subprocess.PIPE,
-    stderr=subprocess.DEVNULL,
-  ) as write:
-    result = subprocess.run(
-      ['taskset', '2', './read'] + flags,
-      check=True,
-      capture_output=True,
-      stdin=write.stdout,
-    )
-    return run_options.name + ',' + result.stdout.decode('utf-8')
+    stderr=subprocess.PIPE,
+  )
+  read = subprocess.Popen(
+    ['taskset', '-c', str(read_cpu), './read'] + flags,
+    stdin=write.stdout,
+    stdout=subprocess.PIPE,
+    stderr=subprocess.PIPE,
+  )
+  # `./read` must hold the only read end of the pipe, so that `./write` gets
+  # EPIPE as soon as `./read` exits rather than spinning until we reap it.
+  write.stdout.close()
+  read_stdout, read_stderr = read.communicate()
+  _, write_stderr = write.communicate()
+  # check `./write` first, if it failed `./read` will just see the pipe closing
+  if write.returncode != 0:
+    sys.exit(f'./write failed: {write_stderr.decode("utf-8").strip()}')
+  if read.returncode != 0:
+    sys.exit(f'./read failed: {read_stderr.decode("utf-8").strip()}')
+  # `./write` can't use stdout, so it prints its own CSV line to stderr
+  write_lines = write_stderr.decode('utf-8').strip().splitlines()
+  if not write_lines:
+    sys.exit('./write did not print its CSV line')
+  fields = read_stdout.decode('utf-8').strip().split(',') + write_lines[-1].split(',')
+  return format_result_row(run_options.name, interference, fields)
+
+# Interference scenarios contain commas (e.g. `membw:2,3`), so the row needs
+# proper CSV quoting.
+def format_result_row(name, interference, fields):
+  row = io.StringIO()
+  csv.writer(row, lineterminator='\n').writerow([name, interference] + fields)
+  return row.getvalue()
 
 class TestCaseGenerator:
   def __init__(self):
@@ -94,6 +129,7 @@ class TestCaseGenerator:
 
 result_dtype = [
   ('name', np.str_),
+  ('interference', np.str_),
   ('gibibytes_per_second', np.double),
   ('buf_size', np.uint),
   ('bytes_to_pipe', np.uint),
@@ -108,15 +144,453 @@ result_dtype = [
   ('lock_memory', np.bool_),
   ('dont_touch_pages', np.bool_),
   ('same_buffer', np.bool_),
+  ('read_user_seconds', np.double),
+  ('read_system_seconds', np.double),
+  ('read_spin_seconds', np.double),
+  ('read_gibibytes_per_cpu_second', np.double),
+  ('write_user_seconds', np.double),
+  ('write_system_seconds', np.double),
+  ('write_spin_seconds', np.double),
+  ('write_gibibytes_per_cpu_second', np.double),
+]
+result_csv_header = 'name,interference,gibibytes_per_second,bytes_to_pipe,buf_size,pipe_size,busy_loop,poll,huge_page,check_huge_page,write_with_vmsplice,read_with_splice,gift,lock_memory,dont_touch_pages,same_buffer,read_user_seconds,read_system_seconds,read_spin_seconds,read_gibibytes_per_cpu_second,write_user_seconds,write_system_seconds,write_spin_seconds,write_gibibytes_per_cpu_second\n'
+
+# Metrics we compare across runs, mapped to whether higher is better. Every
+# other column in `result_dtype` identifies the configuration. Only the
+# throughput metrics can flag a regression: the raw CPU seconds are too noisy
+# (getrusage splits user and system time per tick, and spinning is wall clock
+# time), so they're only reported.
+metrics = {
+  'gibibytes_per_second': True,
+  'gibibytes_per_cpu_second': True,
+  'read_user_seconds': False,
+  'read_system_seconds': False,
+  'read_spin_seconds': False,
+  'read_gibibytes_per_cpu_second': True,
+  'write_user_seconds': False,
+  'write_system_seconds': False,
+  'write_spin_seconds': False,
+  'write_gibibytes_per_cpu_second': True,
+}
+informational_metrics = {
+  'read_user_seconds', 'read_system_seconds', 'read_spin_seconds',
+  'write_user_seconds', 'write_system_seconds', 'write_spin_seconds',
+}
+config_columns = [name for name, _ in result_dtype if name not in metrics]
+
+# Bytes piped per CPU second burned on both sides together, which is what
+# we pay for on a shared host.
+def add_derived_metrics(result):
+  cpu_seconds = result[[
+    'read_user_seconds', 'read_system_seconds', 'write_user_seconds', 'write_system_seconds'
+  ]].sum(axis=1)
+  result['gibibytes_per_cpu_second'] = (result['bytes_to_pipe'] / (1 << 30)) / cpu_seconds
+  return result
+
+def read_sys_file(path):
+  try:
+    with open(path) as f:
+      return f.read().strip()
+  except OSError:
+    return None
+
+def read_sys_int(path):
+  value = read_sys_file(path)
+  return int(value) if value is not None else None
+
+# /sys/kernel/mm/transparent_hugepage/* look like `always [madvise] never`
+def selected_sys_choice(path):
+  value = read_sys_file(path)
+  if value is not None and '[' in value:
+    return value[value.index('[')+1:value.index(']')]
+  return value
+
+def cpu_model():
+  cpuinfo = read_sys_file('/proc/cpuinfo') or ''
+  for line in cpuinfo.splitlines():
+    if line.startswith('model name'):
+      return line.split(':', 1)[1].strip()
+  return None
+
+def harness_commit():
+  result = subprocess.run(
+    ['git', 'rev-parse', 'HEAD'],
+    cwd=os.path.dirname(os.path.abspath(__file__)),
+    capture_output=True,
+  )
+  return result.stdout.decode('utf-8').strip() if result.returncode == 0 else None
+
+# Everything about the host that can move pipe throughput independently of
+# the configuration being measured.
+def collect_environment():
+  uname = os.uname()
+  return {
+    'started_at': datetime.datetime.now(datetime.timezone.utc).isoformat(),
+    'hostname': socket.gethostname(),
+    'kernel_release': uname.release,
+    'kernel_version': uname.version,
+    'cpu_model': cpu_model(),
+    'thp_enabled': selected_sys_choice('/sys/kernel/mm/transparent_hugepage/enabled'),
+    'thp_defrag': selected_sys_choice('/sys/kernel/mm/transparent_hugepage/defrag'),
+    'pipe_max_size': read_sys_int('/proc/sys/fs/pipe-max-size'),
+    'pipe_user_pages_soft': read_sys_int('/proc/sys/fs/pipe-user-pages-soft'),
+    'pipe_user_pages_hard': read_sys_int('/proc/sys/fs/pipe-user-pages-hard'),
+    'harness_commit': harness_commit(),
+  }
+
+# Opens the database read only, without creating it if it's not there.
+def open_db_read_only(path):
+  if not os.path.exists(path):
+    sys.exit(f'no results database at {path}')
+  conn = sqlite3.connect(pathlib.Path(path).resolve().as_uri() + '?mode=ro', uri=True)
+  if 'samples' not in [row[0] for row in conn.execute("SELECT name FROM sqlite_master WHERE type = 'table'")]:
+    sys.exit(f'no results stored in {path}')
+  return conn
+
+def open_db(path):
+  conn = sqlite3.connect(path)
+  conn.execute('''
+    CREATE TABLE IF NOT EXISTS runs (
+      run_id INTEGER PRIMARY KEY AUTOINCREMENT,
+      started_at TEXT,
+      hostname TEXT,
+      kernel_release TEXT,
+      kernel_version TEXT,
+      cpu_model TEXT,
+      thp_enabled TEXT,
+      thp_defrag TEXT,
+      pipe_max_size INTEGER,
+      pipe_user_pages_soft INTEGER,
+      pipe_user_pages_hard INTEGER,
+      harness_commit TEXT,
+      status TEXT
+    )
+  ''')
+  # `status` is `running` while measuring, then `complete` or `failed`. A failed
+  # run keeps the samples of the scenarios that did finish.
+  if 'status' not in table_columns(conn, 'runs'):
+    conn.execute('ALTER TABLE runs ADD COLUMN status TEXT')
+  return conn
+
+def table_columns(conn, table):
+  return [row[1] for row in conn.execute(f'PRAGMA table_info({table})')]
+
+def start_run(conn, environment):
+  environment = dict(environment, status='running')
+  columns = ', '.join(environment.keys())
+  placeholders = ', '.join('?' for _ in environment)
+  cursor = conn.execute(
+    f'INSERT INTO runs ({columns}) VALUES ({placeholders})',
+    list(environment.values()),
+  )
+  conn.commit()
+  return cursor.lastrowid
+
+def finish_run(conn, run_id, status):
+  conn.execute('UPDATE runs SET status = ? WHERE run_id = ?', (status, run_id))
+  conn.commit()
+
+def store_samples(conn, run_id, samples):
+  samples = samples.assign(run_id=run_id)
+  # Older databases might predate some of the CSV columns, add them so that
+  # we can keep appending to the same store.
+  existing = table_columns(conn, 'samples')
+  if existing:
+    for column in samples.columns:
+      if column not in existing:
+        conn.execute(f'ALTER TABLE samples ADD COLUMN "{column}"')
+  samples.to_sql('samples', conn, if_exists='append', index=False)
+  conn.commit()
+
+# Selectors are `column=value` pairs on the `runs` table, e.g.
+# `kernel_release=6.1.0` or `hostname=foo`. All the samples from all the
+# matching runs are pooled together.
+def selectors_where(conn, selectors):
+  runs_columns = table_columns(conn, 'runs')
+  clauses = []
+  params = []
+  for selector in selectors:
+    if '=' not in selector:
+      sys.exit(f'bad selector {selector}, expected column=value')
+    column, value = selector.split('=', 1)
+    if column not in runs_columns:
+      sys.exit(f'unknown column {column} in selector, expected one of {", ".join(runs_columns)}')
+    clauses.append(f'runs.{column} = ?')
+    params.append(value)
+  where = ('WHERE ' + ' AND '.join(clauses)) if clauses else ''
+  return where, params
+
+def select_samples(conn, selectors):
+  where, params = selectors_where(conn, selectors)
+  samples = pandas.read_sql_query(
+    f'SELECT samples.* FROM samples JOIN runs USING (run_id) {where}',
+    conn,
+    params=params,
+  )
+  if samples.empty:
+    sys.exit(f'no samples matching {" ".join(selectors)}')
+  # Runs stored before interference was supported ran on a quiet box
+  if 'interference' in samples:
+    samples['interference'] = samples['interference'].fillna('none')
+  return samples
+
+# The parts of the environment which can explain a difference between runs.
+environment_columns = [
+  'hostname', 'kernel_release', 'cpu_model', 'thp_enabled', 'thp_defrag',
+  'pipe_max_size', 'pipe_user_pages_soft', 'pipe_user_pages_hard',
 ]
-result_csv = 'name,gibibytes_per_second,bytes_to_pipe,buf_size,pipe_size,busy_loop,poll,huge_page,check_huge_page,write_with_vmsplice,read_with_splice,gift,lock_memory,dont_touch_pages,same_buffer\n'
-test_cases = TestCaseGenerator()
-for run_options in tqdm(test_cases, total=(len(test_cases.run_options) * test_cases.iterations)):
-  result_csv += run(run_options)
-with open('raw-data.csv', 'w') as f:
-  f.write(result_csv)
-result = pandas.read_csv('raw-data.csv', dtype=result_dtype)
-result.groupby(
-  list(filter(lambda x: x[0] != 'gibibytes_per_second', map(lambda x: x[0], result_dtype)))
-).mean().to_csv('data.csv')
 
+def select_environments(conn, selectors):
+  where, params = selectors_where(conn, selectors)
+  return pandas.read_sql_query(
+    f'SELECT DISTINCT {", ".join(environment_columns)} FROM runs {where}',
+    conn,
+    params=params,
+  )
+
+# Holm-Bonferroni step-down adjustment, so that testing every configuration
+# and metric doesn't make a false alarm almost certain.
+def holm_adjust(p_values):
+  p_values = np.asarray(p_values, dtype=np.double)
+  order = np.argsort(p_values)
+  m = len(p_values)
+  adjusted = np.empty(m)
+  running_max = 0.0
+  for rank, ix in enumerate(order):
+    running_max = max(running_max, min(1.0, (m - rank) * p_values[ix]))
+    adjusted[ix] = running_max
+  return adjusted
+
+# Two-sided permutation test on the difference of the means. We only get a
+# handful of iterations per configuration and no guarantee of normality, so
+# we don't want to assume much about the distribution.
+def permutation_p_value(baseline, candidate, resamples, rng):
+  observed = abs(candidate.mean() - baseline.mean())
+  pooled = np.concatenate([baseline, candidate])
+  permuted = np.array([rng.permutation(pooled) for _ in range(resamples)])
+  diffs = np.abs(permuted[:, len(baseline):].mean(axis=1) - permuted[:, :len(baseline)].mean(axis=1))
+  return (np.sum(diffs >= observed) + 1) / (resamples + 1)
+
+def compare(args):
+  conn = open_db_read_only(args.db)
+  baseline = select_samples(conn, args.baseline)
+  candidate = select_samples(conn, args.candidate)
+  for side, selectors in [('baseline', args.baseline), ('candidate', args.candidate)]:
+    print(f'{side} environment:')
+    print(select_environments(conn, selectors).to_string(index=False))
+    print()
+  rng = np.random.default_rng(args.seed)
+  keys = [column for column in config_columns if column in baseline.columns and column in candidate.columns]
+  candidate_groups = dict(list(candidate.groupby(keys, dropna=False)))
+  baseline_groups = dict(list(baseline.groupby(keys, dropna=False)))
+  describe = lambda key: f'{key[0]} ({dict(zip(keys, key)).get("interference", "none")} interference)'
+  for key in candidate_groups:
+    if key not in baseline_groups:
+      print(f'configuration {describe(key)} only present in candidate, skipping', file=sys.stderr)
+  rows = []
+  for key, baseline_group in baseline_groups.items():
+    if key not in candidate_groups:
+      print(f'configuration {describe(key)} only present in baseline, skipping', file=sys.stderr)
+      continue
+    candidate_group = candidate_groups[key]
+    for metric, higher_is_better in metrics.items():
+      if metric not in baseline_group or metric not in candidate_group:
+        continue
+      a = baseline_group[metric].dropna().to_numpy(dtype=np.double)
+      b = candidate_group[metric].dropna().to_numpy(dtype=np.double)
+      if len(a) == 0 or len(b) == 0:
+        continue
+      if a.mean() != 0:
+        change = (b.mean() - a.mean()) / a.mean()
+      else: # e.g. no spinning at all in the baseline
+        change = 0.0 if b.mean() == 0 else np.copysign(np.inf, b.mean())
+      rows.append({
+        'name': key[0],
+        'interference': dict(zip(keys, key)).get('interference', 'none'),
+        'metric': metric,
+        'baseline': a.mean(),
+        'candidate': b.mean(),
+        'change': f'{change*100:+.1f}%',
+        'p_value': permutation_p_value(a, b, args.resamples, rng),
+        'n': f'{len(a)}/{len(b)}',
+        'gated': metric not in informational_metrics,
+        'worse': change < 0 if higher_is_better else change > 0,
+        'relative_change': change,
+      })
+  if not rows:
+    sys.exit('no configurations in common between baseline and candidate')
+  report = pandas.DataFrame(rows)
+  report['adjusted_p_value'] = np.nan
+  report.loc[report['gated'], 'adjusted_p_value'] = holm_adjust(report.loc[report['gated'], 'p_value'])
+  significant = report['gated'] & (report['adjusted_p_value'] < args.alpha) & (report['relative_change'].abs() >= args.threshold)
+  report['verdict'] = np.where(significant, np.where(report['worse'], 'REGRESSION', 'improvement'), '')
+  report = report.drop(columns=['gated', 'worse', 'relative_change'])
+  print(report.to_string(index=False))
+  if (report['verdict'] == 'REGRESSION').any():
+    sys.exit(1)
+
+# An interference scenario is a `+` separated list of `mode:cpus[:size]`
+# co-runners for `./interfere`, e.g. `membw:2,3` or `llc:2+page_cache:3:64G`.
+# `size` is passed as `--buf_size`.
+def parse_interference(scenario):
+  co_runners = []
+  for co_runner in scenario.split('+'):
+    parts = co_runner.split(':')
+    if len(parts) not in (2, 3):
+      sys.exit(f'bad interference {co_runner}, expected mode:cpus[:size]')
+    try:
+      cpus = [int(cpu) for cpu in parts[1].split(',')]
+    except ValueError:
+      sys.exit(f'bad cpu list {parts[1]} in interference {co_runner}')
+    if write_cpu in cpus or read_cpu in cpus:
+      sys.exit(f'interference {co_runner} overlaps with cpus {write_cpu} and {read_cpu}, used by ./write and ./read')
+    flags = [f'--mode={parts[0]}', f'--cpus={parts[1]}']
+    if len(parts) == 3:
+      flags.append(f'--buf_size={parts[2]}')
+    co_runners.append(flags)
+  return co_runners
+
+def start_interference(scenario, warmup):
+  co_runners = []
+  for flags in parse_interference(scenario):
+    co_runners.append(subprocess.Popen(
+      ['./interfere'] + flags,
+      stdout=subprocess.DEVNULL,
+    ))
+  # Give the co-runners time to allocate their memory and get going
+  time.sleep(warmup)
+  check_interference(scenario, co_runners)
+  return co_runners
+
+# A co-runner dying (ENOSPC, the OOM killer, ...) would leave us measuring a
+# quiet box while labelling the samples with the scenario, so we give up.
+def check_interference(scenario, co_runners):
+  for co_runner in co_runners:
+    if co_runner.poll() is not None:
+      stop_interference(co_runners)
+      sys.exit(f'interference {scenario} exited with status {co_runner.returncode}: {" ".join(co_runner.args)}')
+
+def stop_interference(co_runners):
+  for co_runner in co_runners:
+    if co_runner.poll() is None:
+      co_runner.terminate()
+  for co_runner in co_runners:
+    co_runner.wait()
+
+# Ranks configurations by their worst throughput across all the interference
+# scenarios, rather than by their throughput on a quiet box. `retained` is
+# the fraction of the quiet throughput left in the worst scenario, and each
+# scenario column is the fraction left under that scenario.
+def robustness_report(samples):
+  means = samples.groupby(['name', 'interference'])['gibibytes_per_second'].mean().unstack('interference')
+  if 'none' not in means:
+    sys.exit('no samples without interference to compare against')
+  quiet = means['none']
+  report = pandas.DataFrame({
+    'quiet': quiet,
+    'worst': means.min(axis=1),
+    'worst_interference': means.idxmin(axis=1),
+    'retained': means.min(axis=1) / quiet,
+  })
+  for scenario in means.columns:
+    if scenario != 'none':
+      report[scenario] = means[scenario] / quiet
+  return report.sort_values('worst', ascending=False)
+
+def robustness(args):
+  conn = open_db_read_only(args.db)
+  selectors = args.select
+  if not selectors:
+    (latest,) = conn.execute('SELECT MAX(run_id) FROM runs').fetchone()
+    if latest is None:
+      sys.exit(f'no runs in {args.db}')
+    selectors = [f'run_id={latest}']
+  samples = select_samples(conn, selectors)
+  if 'interference' not in samples:
+    sys.exit('no interference recorded in the selected runs')
+  print(robustness_report(samples).to_string(float_format='%.3f'))
+
+def parse_results(result_csv):
+  return add_derived_metrics(pandas.read_csv(io.StringIO(result_csv), dtype=result_dtype))
+
+# Makes sure that a row labelled with the scenario parses back to the same
+# label, before we spend any time measuring.
+def check_result_row(scenario):
+  fields = ['0'] * (len(result_dtype) - 2)
+  parsed = parse_results(result_csv_header + format_result_row('check', scenario, fields))
+  if len(parsed) != 1 or parsed['interference'][0] != scenario:
+    sys.exit(f'interference {scenario} does not survive a round trip through the CSV')
+
+def measure(args):
+  environment = collect_environment()
+  scenarios = ['none'] + args.interference
+  for scenario in args.interference:
+    parse_interference(scenario) # fail early on bad scenarios
+    check_result_row(scenario)
+  test_cases = TestCaseGenerator()
+  test_cases.iterations = args.iterations
+  # Each scenario is stored as soon as it's done, so that a failure later on
+  # doesn't lose what we've already measured.
+  conn = open_db(args.db)
+  run_id = start_run(conn, environment)
+  results = []
+  status = 'failed'
+  try:
+    for scenario in scenarios:
+      result_csv = result_csv_header
+      co_runners = start_interference(scenario, args.interference_warmup) if scenario != 'none' else []
+      try:
+        for run_options in tqdm(test_cases, total=(len(test_cases.run_options) * test_cases.iterations), desc=scenario):
+          result_csv += run(run_options, scenario)
+          check_interference(scenario, co_runners)
+      finally:
+        stop_interference(co_runners)
+      results.append(parse_results(result_csv))
+      store_samples(conn, run_id, results[-1])
+    status = 'complete'
+  finally:
+    finish_run(conn, run_id, status)
+    if status != 'complete':
+      print(f'run {run_id} failed, {len(results)} scenarios stored in {args.db}', file=sys.stderr)
+  result = pandas.concat(results, ignore_index=True)
+  result.to_csv('raw-data.csv', index=False)
+  summary = result.groupby(config_columns).mean()
+  summary.to_csv('data.csv')
+  quiet = summary.reset_index()
+  quiet = quiet[quiet['interference'] == 'none']
+  print(
+    quiet[['name', 'gibibytes_per_second', 'gibibytes_per_cpu_second']]
+      .sort_values('gibibytes_per_cpu_second', ascending=False)
+      .to_string(index=False)
+  )
+  if len(scenarios) > 1:
+    print()
+    print(robustness_report(result).to_string(float_format='%.3f'))
+  print(f'stored run {run_id} ({environment["hostname"]}, {environment["kernel_release"]}) in {args.db}')
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--db', default='results.sqlite', help='results database, appended to on every run')
+subparsers = parser.add_subparsers()
+run_parser = subparsers.add_parser('run', help='measure all the configurations (the default)')
+run_parser.add_argument('--iterations', type=int, default=10)
+run_parser.add_argument(
+  '--interference', action='append', default=[], metavar='MODE:CPUS[:SIZE][+MODE:CPUS[:SIZE]...]',
+  help='also measure everything with ./interfere running, can be repeated',
+)
+run_parser.add_argument('--interference_warmup', type=float, default=5, help='seconds')
+run_parser.set_defaults(func=measure)
+compare_parser = subparsers.add_parser('compare', help='flag regressions between two sets of stored runs')
+compare_parser.add_argument('--baseline', nargs='+', required=True, metavar='COLUMN=VALUE')
+compare_parser.add_argument('--candidate', nargs='+', required=True, metavar='COLUMN=VALUE')
+compare_parser.add_argument('--alpha', type=float, default=0.05, help='significance level')
+compare_parser.add_argument('--threshold', type=float, default=0.02, help='minimum relative change to flag')
+compare_parser.add_argument('--resamples', type=int, default=10000)
+compare_parser.add_argument('--seed', type=int, default=0)
+compare_parser.set_defaults(func=compare)
+robustness_parser = subparsers.add_parser('robustness', help='rank configurations by throughput under interference')
+robustness_parser.add_argument('--select', nargs='+', default=[], metavar='COLUMN=VALUE', help='runs to use, the latest by default')
+robustness_parser.set_defaults(func=robustness)
+args = parser.parse_args()
+if not hasattr(args, 'func'):
+  args = parser.parse_args(sys.argv[1:] + ['run'])
+args.func(args)
@@ -22,17 +22,22 @@ static size_t with_read(const Options& options, char* buf) {
   size_t read_count = 0;
   while (read_count < options.bytes_to_pipe) {
     if (options.poll && options.busy_loop) {
-      while (poll(&pollfd, 1, 0) == 0) {}
+      while (poll(&pollfd, 1, 0) == 0) { spin_begin(); }
     } else if (options.poll) {
       poll(&pollfd, 1, -1);
     }
     ssize_t ret = read(STDIN_FILENO, buf, options.buf_size);
     if (ret < 0 && errno == EAGAIN) {
+      spin_begin();
       continue;
     }
     if (ret < 0) {
       fail("read failed: %s", strerror(errno));
     }
+    if (ret == 0) {
+      fail("writer closed the pipe after %zu bytes\n", read_count);
+    }
+    spin_end();
     read_count += ret;
   }
   return read_count;
@@ -47,7 +52,7 @@ static size_t with_splice(const Options& options) {
   int devnull = open("/dev/null", O_WRONLY);
   while (read_count < options.bytes_to_pipe) {
     if (options.poll && options.busy_loop) {
-      while (poll(&pollfd, 1, 0) == 0) {}
+      while (poll(&pollfd, 1, 0) == 0) { spin_begin(); }
     } else if (options.poll) {
       poll(&pollfd, 1, -1);
     }
@@ -56,11 +61,16 @@ static size_t with_splice(const Options& options) {
       (options.busy_loop ? SPLICE_F_NONBLOCK : 0) | (options.gift ? SPLICE_F_MOVE : 0)
     );
     if (ret < 0 && errno == EAGAIN) {
+      spin_begin();
       continue;
     }
     if (ret < 0) {
       fail("splice failed: %s", strerror(errno));
     }
+    if (ret == 0) {
+      fail("writer closed the pipe after %zu bytes\n", read_count);
+    }
+    spin_end();
     read_count += ret;
   }
   close(devnull);
@@ -75,6 +85,7 @@ int main(int argc, char** argv) {
   write_size_str(options.bytes_to_pipe, bytes_to_pipe_str);
   log("will read %s\n", bytes_to_pipe_str);
 
+  start_cpu_usage();
   double t0 = get_millis();
   size_t read_count;
   if (options.read_with_splice) {
@@ -84,12 +95,15 @@ int main(int argc, char** argv) {
     read_count = with_read(options, buf);
   }
   double t1 = get_millis();
+  CpuUsage cpu_usage;
+  stop_cpu_usage(cpu_usage);
+  double gibibytes_per_cpu = gibibytes_per_cpu_second(read_count, cpu_usage);
   double gigabytes_per_second = (((double) read_count) / 1000000) / (t1 - t0);
   // `pv` uses GiB, not GB
   double gibibytes_per_second = gigabytes_per_second * 0.931323;
   if (options.csv) {
     printf(
-      "%f,%zu,%zu,%zu,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n",
+      "%f,%zu,%zu,%zu,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%f,%f,%f,%f\n",
       gibibytes_per_second,
       options.bytes_to_pipe,
       options.buf_size,
@@ -103,7 +117,11 @@ int main(int argc, char** argv) {
       options.gift,
       options.lock_memory,
       options.dont_touch_pages,
-      options.same_buffer
+      options.same_buffer,
+      cpu_usage.user_seconds,
+      cpu_usage.system_seconds,
+      cpu_usage.spin_seconds,
+      gibibytes_per_cpu
     );
   } else {
     char buf_size_str[128];
@@ -115,6 +133,13 @@ int main(int argc, char** argv) {
       options.bytes_to_pipe/options.buf_size,
       bytes_to_pipe_str
     );
+    printf(
+      "%.1fGiB per CPU second (%.2fs user, %.2fs system, %.2fs spinning)\n",
+      gibibytes_per_cpu,
+      cpu_usage.user_seconds,
+      cpu_usage.system_seconds,
+      cpu_usage.spin_seconds
+    );
   }
 
   return 0;
@@ -1,7 +1,7 @@
 #include "common.hpp"
 
 NOINLINE UNUSED
-static void with_write(const Options& options, char* buf) {
+static size_t with_write(const Options& options, char* buf) {
   if (options.busy_loop) {
     if (fcntl(STDOUT_FILENO, F_SETFL, O_NONBLOCK) < 0) {
       fail("could not mark stdout pipe as non blocking: %s", strerror(errno));
@@ -10,12 +10,13 @@ static void with_write(const Options& options, char* buf) {
   struct pollfd pollfd;
   pollfd.fd = STDOUT_FILENO;
   pollfd.events = POLLOUT | POLLWRBAND;
+  size_t write_count = 0;
   while (true) {
     char* cursor = buf;
     ssize_t remaining = options.buf_size;
     while (remaining > 0) {
       if (options.poll && options.busy_loop) {
-        while (poll(&pollfd, 1, 0) == 0) {}
+        while (poll(&pollfd, 1, 0) == 0) { spin_begin(); }
       } else if (options.poll) {
         poll(&pollfd, 1, -1);
       }
@@ -25,21 +26,24 @@ static void with_write(const Options& options, char* buf) {
       }
       // we never seem to get stuck here when writing manually
       if (ret < 0 && errno == EAGAIN) {
+        spin_begin();
         continue;
       }
       if (ret < 0) {
         fail("read failed: %s", strerror(errno));
       }
+      spin_end();
+      write_count += ret;
       cursor += ret;
       remaining -= ret;
     }
   }
 finished:
-  return;
+  return write_count;
 }
 
 NOINLINE UNUSED
-static void with_vmsplice(const Options& options, char* bufs[2]) {
+static size_t with_vmsplice(const Options& options, char* bufs[2]) {
   struct pollfd pollfd = {
     .fd = STDOUT_FILENO,
     .events = POLLOUT | POLLWRBAND
@@ -49,6 +53,7 @@ static void with_vmsplice(const Options& options, char* bufs[2]) {
   // is ready to read. This simulates one possible measure when streaming
   // to a pipe with vmsplice.
   size_t buf_ix = 0;
+  size_t write_count = 0;
   while (true) {
     struct iovec bufvec {
       .iov_base = bufs[buf_ix],
@@ -57,7 +62,7 @@ static void with_vmsplice(const Options& options, char* bufs[2]) {
     buf_ix = (buf_ix + 1) % 2;
     while (bufvec.iov_len > 0) {
       if (options.poll && options.busy_loop) {
-        while (poll(&pollfd, 1, 0) == 0) {}
+        while (poll(&pollfd, 1, 0) == 0) { spin_begin(); }
       } else if (options.poll) {
         poll(&pollfd, 1, -1);
       }
@@ -69,17 +74,20 @@ static void with_vmsplice(const Options& options, char* bufs[2]) {
         goto finished;
       }
       if (ret < 0 && errno == EAGAIN) {
+        spin_begin();
         continue;
       }
       if (ret < 0) {
         fail("vmsplice failed: %s", strerror(errno));
       }
+      spin_end();
+      write_count += ret;
       bufvec.iov_base = (void*) (((char*) bufvec.iov_base) + ret);
       bufvec.iov_len -= ret;
     }
   }
 finished:
-  return;
+  return write_count;
 }
 
 int main(int argc, char** argv) {
@@ -116,6 +124,8 @@ int main(int argc, char** argv) {
 
   reset_perf_count();
   enable_perf_count();
+  start_cpu_usage();
+  size_t write_count;
   if (options.write_with_vmsplice) {
     char* bufs[2];
     if (options.same_buffer) {
@@ -128,15 +138,37 @@ int main(int argc, char** argv) {
       bufs[1] = allocate_buf(options);
     }
     log("starting to write\n");
-    with_vmsplice(options, bufs);
+    write_count = with_vmsplice(options, bufs);
   } else {
     char* buf = allocate_buf(options);
     log("starting to write\n");
-    with_write(options, buf);
+    write_count = with_write(options, buf);
   }
+  CpuUsage cpu_usage;
+  stop_cpu_usage(cpu_usage);
   disable_perf_count();
   log_perf_count();
 
+  // stdout is the pipe, so the CSV line for the writing side goes to stderr.
+  double gibibytes_per_cpu = gibibytes_per_cpu_second(write_count, cpu_usage);
+  if (options.csv) {
+    fprintf(
+      stderr, "%f,%f,%f,%f\n",
+      cpu_usage.user_seconds,
+      cpu_usage.system_seconds,
+      cpu_usage.spin_seconds,
+      gibibytes_per_cpu
+    );
+  } else {
+    log(
+      "%.1fGiB per CPU second (%.2fs user, %.2fs system, %.2fs spinning)\n",
+      gibibytes_per_cpu,
+      cpu_usage.user_seconds,
+      cpu_usage.system_seconds,
+      cpu_usage.spin_seconds
+    );
+  }
+
   perf_close();
 
   return 0;